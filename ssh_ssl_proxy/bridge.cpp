@@ -64,28 +64,227 @@
  http://cboard.cprogramming.com/networking-device-communication/166336-detecting-ssl-tls-client-handshake.html
 */
 
+#include <cerrno>
+#include <netinet/tcp.h>
+
 #include "bridge.h"
 
 namespace ssh_ssl_proxy
 {
    namespace ip = boost::asio::ip;
 
-  void bridge::start(const std::string& upstream_host, unsigned short upstream_port, const unsigned char *buffer)
+  void bridge::start(const endpoint_type& upstream, const unsigned char *buffer, sockmap *offload)
   {
 	 try
 	 {
-		 upstream_socket_.connect(ip::tcp::endpoint(
-			 boost::asio::ip::address::from_string(upstream_host),
-			 upstream_port));
-		 boost::asio::write(upstream_socket_, boost::asio::buffer(buffer, 6));
+		 upstream_socket_.open(upstream.protocol());
+		 enable_fast_open_connect(upstream);
+		 upstream_socket_.connect(upstream);
+
+		 // whatever the client sent beyond the sniffed prefix goes out in
+		 // the same write, with fast open already in the SYN
+		 ssize_t bytes_transferred = ::recv(downstream_socket_.native_handle(),
+			 downstream_data_, max_data_length, MSG_DONTWAIT);
+		 boost::array<boost::asio::const_buffer, 2> buffers = {{
+			 boost::asio::buffer(buffer, 6),
+			 boost::asio::buffer(downstream_data_, bytes_transferred > 0 ? bytes_transferred : 0)
+		 }};
+		 boost::asio::write(upstream_socket_, buffers);
+		 if (offload && can_offload(upstream))
+			 offload_ = offload;
 	 }
 	 catch (const boost::system::system_error &e)
 	 {
 		 close();
 	 }
+	 if (offload_)
+	 {
+		 handle_downstream_ready(boost::system::error_code());
+		 handle_upstream_ready(boost::system::error_code());
+		 return;
+	 }
 	 handle_upstream_connect();
   }
 
+  void bridge::enable_fast_open_connect(const endpoint_type& upstream)
+  {
+#ifdef TCP_FASTOPEN_CONNECT
+	 // connect() returns at once and the first write carries the SYN;
+	 // the kernel falls back to a normal handshake without a cookie
+	 int family = upstream.protocol().family();
+	 if (family == AF_INET || family == AF_INET6)
+	 {
+		int enable = 1;
+		::setsockopt(upstream_socket_.native_handle(), IPPROTO_TCP,
+			TCP_FASTOPEN_CONNECT, &enable, sizeof(enable));
+	 }
+#endif
+  }
+
+  bool bridge::can_offload(const endpoint_type& upstream)
+  {
+	 // the sockmap keys are IPv4 address tuples, local and IPv6 upstreams
+	 // stay on the normal relay
+	 return upstream.protocol().family() == AF_INET
+		 && downstream_socket_.local_endpoint().address().is_v4();
+  }
+
+  // Relay used while a bridge is waiting for the sockmap offload. It waits
+  // for readiness instead of reading, so a direction that waits holds no
+  // data in user space. Once both wait, the sockets go into the map; after
+  // that the waits complete only on end of stream or errors.
+  void bridge::handle_downstream_ready(const boost::system::error_code& error)
+  {
+	 if (error)
+	 {
+		close();
+		return;
+	 }
+	 downstream_waiting_ = false;
+	 for (;;)
+	 {
+		ssize_t bytes_transferred = ::recv(downstream_socket_.native_handle(),
+			 downstream_data_, max_data_length, MSG_DONTWAIT);
+		if (bytes_transferred > 0)
+		{
+		   async_write(upstream_socket_,
+				 boost::asio::buffer(downstream_data_, bytes_transferred),
+				 boost::bind(&bridge::handle_downstream_ready,
+					   shared_from_this(),
+					   boost::asio::placeholders::error));
+		   return;
+		}
+		if (bytes_transferred < 0 && errno == EINTR)
+		   continue;
+		if (bytes_transferred == 0 && offloaded_)
+		{
+		   if (!downstream_eof_)
+		   {
+			  downstream_eof_ = true;
+			  handle_offload_eof(boost::system::error_code());
+		   }
+		   break;
+		}
+		if (bytes_transferred == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+		   close();
+		   return;
+		}
+		try_offload(upstream_waiting_);
+		break;
+	 }
+	 downstream_waiting_ = true;
+	 downstream_socket_.async_read_some(
+		 boost::asio::null_buffers(),
+		 boost::bind(&bridge::handle_downstream_ready,
+			  shared_from_this(),
+			  boost::asio::placeholders::error));
+  }
+
+  void bridge::handle_upstream_ready(const boost::system::error_code& error)
+  {
+	 if (error)
+	 {
+		close();
+		return;
+	 }
+	 upstream_waiting_ = false;
+	 for (;;)
+	 {
+		ssize_t bytes_transferred = ::recv(upstream_socket_.native_handle(),
+			 upstream_data_, max_data_length, MSG_DONTWAIT);
+		if (bytes_transferred > 0)
+		{
+		   async_write(downstream_socket_,
+				 boost::asio::buffer(upstream_data_, bytes_transferred),
+				 boost::bind(&bridge::handle_upstream_ready,
+					   shared_from_this(),
+					   boost::asio::placeholders::error));
+		   return;
+		}
+		if (bytes_transferred < 0 && errno == EINTR)
+		   continue;
+		if (bytes_transferred == 0 && offloaded_)
+		{
+		   if (!upstream_eof_)
+		   {
+			  upstream_eof_ = true;
+			  handle_offload_eof(boost::system::error_code());
+		   }
+		   break;
+		}
+		if (bytes_transferred == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+		   close();
+		   return;
+		}
+		try_offload(downstream_waiting_);
+		break;
+	 }
+	 upstream_waiting_ = true;
+	 upstream_socket_.async_read_some(
+		 boost::asio::null_buffers(),
+		 boost::bind(&bridge::handle_upstream_ready,
+			  shared_from_this(),
+			  boost::asio::placeholders::error));
+  }
+
+  // Called when one side has nothing to read. If the other side waits as
+  // well, nothing is on its way through user space and the sockets go into
+  // the map. A bridge that can not be offloaded stays on this relay.
+  void bridge::try_offload(bool peer_waiting)
+  {
+	 if (!offload_ || offloaded_ || !peer_waiting)
+		return;
+	 int downstream = downstream_socket_.native_handle();
+	 int upstream = upstream_socket_.native_handle();
+	 // taken before the insert, while no data is forwarded, so they are exact
+	 if (offload_->forward_offset(downstream, upstream, downstream_offset_)
+		   && offload_->forward_offset(upstream, downstream, upstream_offset_)
+		   && offload_->insert(downstream, upstream))
+		offloaded_ = true;
+	 else
+		offload_ = 0;
+  }
+
+  // An offloaded side reached end of stream. Its peer is shut down for
+  // writing only when the kernel has sent all redirected data to it, which
+  // is polled; the bridge is closed when both directions are finished.
+  void bridge::handle_offload_eof(const boost::system::error_code& error)
+  {
+	 if (error == boost::asio::error::operation_aborted || !downstream_socket_.is_open())
+		return;
+	 if (downstream_eof_ && !upstream_shut_)
+		upstream_shut_ = shutdown_forwarded(downstream_socket_, upstream_socket_, downstream_offset_);
+	 if (upstream_eof_ && !downstream_shut_)
+		downstream_shut_ = shutdown_forwarded(upstream_socket_, downstream_socket_, upstream_offset_);
+	 if (downstream_shut_ && upstream_shut_)
+	 {
+		close();
+		return;
+	 }
+	 if (downstream_eof_ != upstream_shut_ || upstream_eof_ != downstream_shut_)
+	 {
+		eof_timer_.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(eof_poll_interval)));
+		eof_timer_.async_wait(boost::bind(&bridge::handle_offload_eof,
+			  shared_from_this(),
+			  boost::asio::placeholders::error));
+	 }
+  }
+
+  template<typename From, typename To>
+  bool bridge::shutdown_forwarded(From& from, To& to, long long offset)
+  {
+	 long long current;
+	 // the FIN of `from` counts as one received byte
+	 if (offload_->forward_offset(from.native_handle(), to.native_handle(), current)
+		   && current < offset - 1)
+		return false;
+	 boost::system::error_code ignored;
+	 to.shutdown(boost::asio::socket_base::shutdown_send, ignored);
+	 return true;
+  }
+
   void bridge::handle_upstream_connect()
   {
 	upstream_socket_.async_read_some(
@@ -166,12 +365,27 @@ namespace ssh_ssl_proxy
   void bridge::close()
   {
 	 boost::mutex::scoped_lock lock(mutex_);
+	 boost::system::error_code ignored;
+	 eof_timer_.cancel(ignored);
 	 if (downstream_socket_.is_open())
 		downstream_socket_.close();
 	 if (upstream_socket_.is_open())
 		upstream_socket_.close();
   }
 
+	void bridge::acceptor::enable_fast_open()
+	{
+#ifdef TCP_FASTOPEN
+		// clients with a cookie get their first bytes accepted with the SYN
+		int queue_length = fast_open_queue_length;
+		if (::setsockopt(acceptor_.native_handle(), IPPROTO_TCP, TCP_FASTOPEN,
+				&queue_length, sizeof(queue_length)) < 0)
+		{
+			std::cerr << "acceptor: TCP fast open not available" << std::endl;
+		}
+#endif
+	}
+
 	bool bridge::acceptor::accept_connections()
 	{
 		try
@@ -232,7 +446,6 @@ namespace ssh_ssl_proxy
 		   try
 		   {
 			   boost::asio::read(session_->downstream_socket(), boost::asio::buffer(buffer, 6));
-			   upstream_port_ = isSSL(buffer) ?  upstream_port_ssl_ : upstream_port_ssh_;
 		   }
 		   catch (const boost::system::system_error &e)
 		   {
@@ -240,7 +453,7 @@ namespace ssh_ssl_proxy
 			   return;
 		   }
 
-		   session_->start(upstream_host_,upstream_port_, buffer);
+		   session_->start(isSSL(buffer) ? upstream_ssl_ : upstream_ssh_, buffer, offload_);
 		   if (!accept_connections())
 		   {
 			  std::cerr << "Failure during call to accept." << std::endl;
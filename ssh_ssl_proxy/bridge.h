@@ -64,6 +64,7 @@
  */
 
 #include "ssh_ssl_proxy.h"
+#include "sockmap.h"
 
 namespace ssh_ssl_proxy {
 namespace ip = boost::asio::ip;
@@ -72,26 +73,42 @@ class bridge: public boost::enable_shared_from_this<bridge> {
 public:
 
 	typedef ip::tcp::socket socket_type;
+	// upstream is either tcp or a local stream socket
+	typedef boost::asio::generic::stream_protocol::socket upstream_socket_type;
+	typedef boost::asio::generic::stream_protocol::endpoint endpoint_type;
 	typedef boost::shared_ptr<bridge> ptr_type;
 
 	bridge(boost::asio::io_service& ios) :
-			downstream_socket_(ios), upstream_socket_(ios) {
+			downstream_socket_(ios), upstream_socket_(ios), offload_(0), offloaded_(
+					false), downstream_waiting_(false), upstream_waiting_(false), downstream_offset_(
+					0), upstream_offset_(0), downstream_eof_(false), upstream_eof_(
+					false), downstream_shut_(false), upstream_shut_(false), eof_timer_(
+					ios) {
 	}
 
 	socket_type& downstream_socket() {
 		return downstream_socket_;
 	}
 
-	socket_type& upstream_socket() {
+	upstream_socket_type& upstream_socket() {
 		return upstream_socket_;
 	}
 
-	void start(const std::string& upstream_host, unsigned short upstream_port,
-			const unsigned char *buffer);
+	void start(const endpoint_type& upstream, const unsigned char *buffer,
+			sockmap *offload);
 	void handle_upstream_connect();
 
 private:
 
+	void enable_fast_open_connect(const endpoint_type& upstream);
+	bool can_offload(const endpoint_type& upstream);
+	void handle_downstream_ready(const boost::system::error_code& error);
+	void handle_upstream_ready(const boost::system::error_code& error);
+	void try_offload(bool peer_waiting);
+	void handle_offload_eof(const boost::system::error_code& error);
+	template<typename From, typename To>
+	bool shutdown_forwarded(From& from, To& to, long long offset);
+
 	void handle_downstream_write(const boost::system::error_code& error);
 	void handle_downstream_read(const boost::system::error_code& error,
 			const size_t& bytes_transferred);
@@ -101,14 +118,29 @@ private:
 	void close();
 
 	socket_type downstream_socket_;
-	socket_type upstream_socket_;
+	upstream_socket_type upstream_socket_;
 
 	enum {
 		max_data_length = 8192
 	}; //8KB
+	enum {
+		eof_poll_interval = 5
+	}; //ms
 	unsigned char downstream_data_[max_data_length];
 	unsigned char upstream_data_[max_data_length];
 
+	sockmap *offload_;
+	bool offloaded_;
+	bool downstream_waiting_;
+	bool upstream_waiting_;
+	long long downstream_offset_;
+	long long upstream_offset_;
+	bool downstream_eof_;
+	bool upstream_eof_;
+	bool downstream_shut_;
+	bool upstream_shut_;
+	boost::asio::deadline_timer eof_timer_;
+
 	boost::mutex mutex_;
 
 public:
@@ -118,21 +150,24 @@ public:
 
 		acceptor(boost::asio::io_service& io_service,
 				const std::string& local_host, unsigned short local_port,
-				const std::string& upstream_host,
-				unsigned short upstream_port_ssh,
-				unsigned short upstream_port_ssl) :
+				const endpoint_type& upstream_ssh,
+				const endpoint_type& upstream_ssl, sockmap *offload = 0) :
 				io_service_(io_service), localhost_address(
 						boost::asio::ip::address_v4::from_string(local_host)), acceptor_(
 						io_service_,
-						ip::tcp::endpoint(localhost_address, local_port)), upstream_port_ssh_(
-						upstream_port_ssh), upstream_port_ssl_(
-						upstream_port_ssl), upstream_port_(0), upstream_host_(
-						upstream_host) {
+						ip::tcp::endpoint(localhost_address, local_port)), upstream_ssh_(
+						upstream_ssh), upstream_ssl_(upstream_ssl), offload_(
+						offload) {
+			enable_fast_open();
 		}
 
 		bool accept_connections();
 
 	private:
+		enum {
+			fast_open_queue_length = 256
+		};
+		void enable_fast_open();
 		bool isSSL(const unsigned char * buffers);
 		void handle_accept(const boost::system::error_code& error);
 
@@ -140,10 +175,9 @@ public:
 		ip::address_v4 localhost_address;
 		ip::tcp::acceptor acceptor_;
 		ptr_type session_;
-		unsigned short upstream_port_ssh_;
-		unsigned short upstream_port_ssl_;
-		unsigned short upstream_port_;
-		std::string upstream_host_;
+		endpoint_type upstream_ssh_;
+		endpoint_type upstream_ssl_;
+		sockmap *offload_;
 	};
 
 };
@@ -25,12 +25,23 @@
  	 forward_host=192.168.2.13
  	 forward_port_ssh=22
  	 forward_port_ssl=443
+ 	 sockmap=0
+
+ forward_port_ssh and forward_port_ssl also accept unix:/path/to.sock,
+ the connection is then forwarded to a local stream socket instead of
+ forward_host, e.g. forward_port_ssh=unix:/run/sshd.sock
+
+ sockmap=1 offloads classified bridges to the kernel (Linux, needs CAP_BPF
+ or root); the normal relay is used if that is not possible.
+ sockmap_max_bridges (default 32768) limits how many bridges are offloaded
+ at once, later ones use the normal relay until others close.
 
  */
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/ini_parser.hpp>
 #include <exception>
+#include <sys/un.h>
 
 #include "configuration.h"
 
@@ -38,7 +49,7 @@ namespace ssh_ssl_proxy {
 
 configuration::configuration(int argc, char* argv[]) :
 		m_argc(argc), m_argv(argv), m_local_port(0), m_forward_port_ssh(22), m_forward_port_ssl(
-				443) {
+				443), m_sockmap(false), m_sockmap_max_bridges(32768) {
 }
 
 configuration::~configuration() {
@@ -52,11 +63,24 @@ void configuration::load() {
 		m_local_port = static_cast<unsigned short>(::atoi(
 				pt.get<std::string>("localport").c_str()));
 		m_local_host = pt.get<std::string>("localhost");
-		m_forward_host = pt.get<std::string>("forward_host");
-		m_forward_port_ssh = static_cast<unsigned short>(::atoi(
-				pt.get<std::string>("forward_port_ssh").c_str()));
-		m_forward_port_ssl = static_cast<unsigned short>(::atoi(
-				pt.get<std::string>("forward_port_ssl").c_str()));
+		m_forward_host = pt.get<std::string>("forward_host", "");
+		parse_forward("forward_port_ssh", pt.get<std::string>("forward_port_ssh"),
+				m_forward_port_ssh, m_forward_path_ssh);
+		parse_forward("forward_port_ssl", pt.get<std::string>("forward_port_ssl"),
+				m_forward_port_ssl, m_forward_path_ssl);
+		if (m_forward_host.empty()
+				&& (m_forward_path_ssh.empty() || m_forward_path_ssl.empty())) {
+			throw std::runtime_error(
+					"forward_host is required when forward_port_ssh or forward_port_ssl is numeric");
+		}
+		m_sockmap = ::atoi(pt.get<std::string>("sockmap", "0").c_str()) != 0;
+		int max_bridges = ::atoi(
+				pt.get<std::string>("sockmap_max_bridges", "32768").c_str());
+		if (max_bridges <= 0) {
+			throw std::runtime_error(
+					"sockmap_max_bridges must be a positive number");
+		}
+		m_sockmap_max_bridges = static_cast<unsigned int>(max_bridges);
 		return;
 	}
 	if (m_argc == 4) {
@@ -70,6 +94,42 @@ void configuration::load() {
 	throw std::runtime_error("wrong parameters");
 }
 
+boost::asio::generic::stream_protocol::endpoint configuration::forward_ssh() {
+	return forward_endpoint(m_forward_port_ssh, m_forward_path_ssh);
+}
+
+boost::asio::generic::stream_protocol::endpoint configuration::forward_ssl() {
+	return forward_endpoint(m_forward_port_ssl, m_forward_path_ssl);
+}
+
+void configuration::parse_forward(const std::string &key,
+		const std::string &value, unsigned short &port, std::string &path) {
+	static const std::string unix_prefix("unix:");
+	if (value.compare(0, unix_prefix.size(), unix_prefix) == 0) {
+		path = value.substr(unix_prefix.size());
+		// the daemon changes its directory to / after start
+		if (path.empty() || path[0] != '/') {
+			throw std::runtime_error(
+					key + " needs an absolute path after unix:");
+		}
+		if (path.size() >= sizeof(sockaddr_un().sun_path)) {
+			throw std::runtime_error(
+					key + " path is longer than a unix socket allows");
+		}
+		return;
+	}
+	port = static_cast<unsigned short>(::atoi(value.c_str()));
+}
+
+boost::asio::generic::stream_protocol::endpoint configuration::forward_endpoint(
+		unsigned short port, const std::string &path) {
+	if (!path.empty()) {
+		return boost::asio::local::stream_protocol::endpoint(path);
+	}
+	return boost::asio::ip::tcp::endpoint(
+			boost::asio::ip::address::from_string(m_forward_host), port);
+}
+
 void configuration::show_usage() {
 	std::cerr
 			<< "usage: ssh_ssl_proxy <local host ip> <local port> <forward host ip>"
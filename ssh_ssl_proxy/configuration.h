@@ -36,10 +36,15 @@ public:
 	void show_usage();
 	unsigned short local_port(){return m_local_port;};
 	std::string &local_host(){return m_local_host;};
-	std::string &forward_host(){return m_forward_host;};
-	unsigned short forward_port_ssh(){return m_forward_port_ssh;};
-	unsigned short forward_port_ssl(){return m_forward_port_ssl;};
+	boost::asio::generic::stream_protocol::endpoint forward_ssh();
+	boost::asio::generic::stream_protocol::endpoint forward_ssl();
+	bool sockmap(){return m_sockmap;};
+	unsigned int sockmap_max_bridges(){return m_sockmap_max_bridges;};
 private:
+	void parse_forward(const std::string &key, const std::string &value,
+			unsigned short &port, std::string &path);
+	boost::asio::generic::stream_protocol::endpoint forward_endpoint(
+			unsigned short port, const std::string &path);
 	int m_argc;
 	char ** m_argv;
 	unsigned short m_local_port;
@@ -47,6 +52,10 @@ private:
 	std::string m_forward_host;
 	unsigned short  m_forward_port_ssh;
 	unsigned short  m_forward_port_ssl;
+	std::string m_forward_path_ssh;
+	std::string m_forward_path_ssl;
+	bool m_sockmap;
+	unsigned int m_sockmap_max_bridges;
 };
 
 } /* namespace Configuration */
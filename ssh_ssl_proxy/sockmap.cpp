@@ -0,0 +1,351 @@
+/*
+  sockmap.cpp
+
+ This file is part of ssh_ssl_proxy.
+
+ ssh_ssl_proxy is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ssh_ssl_proxy is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ssh_ssl_proxy.  If not, see <http://www.gnu.org/licenses/>.
+
+ The programs are assembled by hand so that neither clang nor libbpf
+ is needed to build the proxy. Verdict program:
+
+	r6 = r1
+	key.local_ip4   = skb->local_ip4
+	key.remote_ip4  = skb->remote_ip4
+	key.local_port  = skb->local_port
+	key.remote_port = skb->remote_port  (normalized, see below)
+	bpf_sk_redirect_hash(skb, peer_map, &key, 0)
+	return SK_PASS
+
+ Some kernels hand out remote_port shifted left by 16 bits, so the value
+ is folded with its upper half and masked; the result is the port in
+ network byte order either way.
+ Parser program just returns skb->len - the whole skb is one message.
+ Both programs are attached to the map the sockets are activated in, the
+ peer map the verdict redirects through has none.
+ */
+
+#include "sockmap.h"
+
+#ifdef __linux__
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/bpf.h>
+#endif
+
+namespace ssh_ssl_proxy {
+
+#ifdef __linux__
+
+namespace {
+
+enum {
+	log_size = 65536
+};
+
+// struct tcp_info of the C library ends before the byte counters and
+// <linux/tcp.h> clashes with it, so the kernel layout goes on here
+struct tcp_info_bytes {
+	tcp_info info;
+	uint64_t tcpi_pacing_rate;
+	uint64_t tcpi_max_pacing_rate;
+	uint64_t tcpi_bytes_acked;
+	uint64_t tcpi_bytes_received;
+	uint32_t tcpi_segs_out;
+	uint32_t tcpi_segs_in;
+	uint32_t tcpi_notsent_bytes;
+	uint32_t tcpi_min_rtt;
+	uint32_t tcpi_data_segs_in;
+	uint32_t tcpi_data_segs_out;
+	uint64_t tcpi_delivery_rate;
+	uint64_t tcpi_busy_time;
+	uint64_t tcpi_rwnd_limited;
+	uint64_t tcpi_sndbuf_limited;
+	uint32_t tcpi_delivered;
+	uint32_t tcpi_delivered_ce;
+	uint64_t tcpi_bytes_sent;
+	uint64_t tcpi_bytes_retrans;
+};
+
+int bpf(int cmd, union bpf_attr &attr) {
+	return static_cast<int>(::syscall(__NR_bpf, cmd, &attr, sizeof(attr)));
+}
+
+bpf_insn insn(unsigned char code, unsigned char dst, unsigned char src,
+		short off, int imm) {
+	bpf_insn i;
+	std::memset(&i, 0, sizeof(i));
+	i.code = code;
+	i.dst_reg = dst;
+	i.src_reg = src;
+	i.off = off;
+	i.imm = imm;
+	return i;
+}
+
+int load_program(const bpf_insn *insns, size_t count, const char *name) {
+	static char log[log_size];
+	union bpf_attr attr;
+	std::memset(&attr, 0, sizeof(attr));
+	log[0] = 0;
+	attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+	attr.insns = reinterpret_cast<unsigned long>(insns);
+	attr.insn_cnt = static_cast<unsigned int>(count);
+	attr.license = reinterpret_cast<unsigned long>("GPL");
+	attr.log_buf = reinterpret_cast<unsigned long>(log);
+	attr.log_size = log_size;
+	attr.log_level = 1;
+	int fd = bpf(BPF_PROG_LOAD, attr);
+	if (fd < 0) {
+		std::cerr << "sockmap: loading " << name << " program failed: "
+				<< std::strerror(errno) << std::endl;
+		if (log[0])
+			std::cerr << log << std::endl;
+	}
+	return fd;
+}
+
+int create_map(unsigned int key_size, unsigned int max_entries) {
+	union bpf_attr attr;
+	std::memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_SOCKHASH;
+	attr.key_size = key_size;
+	attr.value_size = sizeof(int);
+	attr.max_entries = max_entries;
+	int fd = bpf(BPF_MAP_CREATE, attr);
+	if (fd < 0) {
+		std::cerr << "sockmap: creating map failed: " << std::strerror(errno)
+				<< std::endl;
+	}
+	return fd;
+}
+
+int attach_program(int prog_fd, int map_fd, bpf_attach_type type) {
+	union bpf_attr attr;
+	std::memset(&attr, 0, sizeof(attr));
+	attr.target_fd = static_cast<unsigned int>(map_fd);
+	attr.attach_bpf_fd = static_cast<unsigned int>(prog_fd);
+	attr.attach_type = type;
+	return bpf(BPF_PROG_ATTACH, attr);
+}
+
+bool get_tcp_info(int fd, tcp_info_bytes &info) {
+	socklen_t len = sizeof(info);
+	if (::getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+		return false;
+	// the byte counters came with 4.19
+	return len >= offsetof(tcp_info_bytes, tcpi_bytes_retrans)
+			+ sizeof(info.tcpi_bytes_retrans);
+}
+
+// data queued before a socket was activated is only parsed with the next
+// packet; updating the receive low water mark runs the parser right away
+void flush_queued(int fd) {
+	int lowat = 1;
+	::setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+}
+
+}
+
+sockmap::sockmap() :
+		m_peer_map_fd(-1), m_map_fd(-1), m_parser_fd(-1), m_verdict_fd(-1), m_insert_failing(
+				false) {
+}
+
+sockmap::~sockmap() {
+	unload();
+}
+
+bool sockmap::load(unsigned int max_bridges) {
+	// kernels before 5.11 charge bpf memory against RLIMIT_MEMLOCK
+	struct rlimit rl = { RLIM_INFINITY, RLIM_INFINITY };
+	::setrlimit(RLIMIT_MEMLOCK, &rl);
+
+	// one entry per socket in each map
+	m_peer_map_fd = create_map(sizeof(key), 2 * max_bridges);
+	m_map_fd = create_map(sizeof(key), 2 * max_bridges);
+	if (m_peer_map_fd < 0 || m_map_fd < 0) {
+		unload();
+		return false;
+	}
+
+	const bpf_insn parser[] = {
+		insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_1, offsetof(__sk_buff, len), 0),
+		insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+	};
+	const bpf_insn verdict[] = {
+		insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+		insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(__sk_buff, local_ip4), 0),
+		insn(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, int(offsetof(key, local_ip4)) - 16, 0),
+		insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(__sk_buff, remote_ip4), 0),
+		insn(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, int(offsetof(key, remote_ip4)) - 16, 0),
+		insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(__sk_buff, local_port), 0),
+		insn(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, int(offsetof(key, local_port)) - 16, 0),
+		insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(__sk_buff, remote_port), 0),
+		insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_2, 0, 0),
+		insn(BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_3, 0, 0, 16),
+		insn(BPF_ALU64 | BPF_OR | BPF_X, BPF_REG_2, BPF_REG_3, 0, 0),
+		insn(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_2, 0, 0, 0xffff),
+		insn(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, int(offsetof(key, remote_port)) - 16, 0),
+		insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+		insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, m_peer_map_fd),
+		insn(0, 0, 0, 0, 0),
+		insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+		insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16),
+		insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+		insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+		insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+		insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+	};
+
+	m_parser_fd = load_program(parser, sizeof(parser) / sizeof(parser[0]), "parser");
+	m_verdict_fd = load_program(verdict, sizeof(verdict) / sizeof(verdict[0]), "verdict");
+	if (m_parser_fd < 0 || m_verdict_fd < 0) {
+		unload();
+		return false;
+	}
+	if (attach_program(m_parser_fd, m_map_fd, BPF_SK_SKB_STREAM_PARSER) < 0
+			|| attach_program(m_verdict_fd, m_map_fd, BPF_SK_SKB_STREAM_VERDICT) < 0) {
+		std::cerr << "sockmap: attaching programs failed: "
+				<< std::strerror(errno) << std::endl;
+		unload();
+		return false;
+	}
+	return true;
+}
+
+bool sockmap::insert(int downstream_fd, int upstream_fd) {
+	key downstream_key, upstream_key;
+	if (!loaded() || !make_key(downstream_fd, downstream_key)
+			|| !make_key(upstream_fd, upstream_key))
+		return false;
+	// nothing is redirected before a socket is activated, so the peer map
+	// entries can still be taken back
+	if (!update(m_peer_map_fd, upstream_key, downstream_fd))
+		return false;
+	if (!update(m_peer_map_fd, downstream_key, upstream_fd)
+			|| !update(m_map_fd, downstream_key, downstream_fd)) {
+		erase(m_peer_map_fd, upstream_key);
+		erase(m_peer_map_fd, downstream_key);
+		return false;
+	}
+	// the client data goes through the kernel now; if the upstream can not
+	// be activated its data is still read and relayed from user space
+	if (update(m_map_fd, upstream_key, upstream_fd))
+		m_insert_failing = false;
+	flush_queued(downstream_fd);
+	flush_queued(upstream_fd);
+	return true;
+}
+
+bool sockmap::forward_offset(int from_fd, int to_fd, long long &offset) {
+	tcp_info_bytes from, to;
+	// `from` first: nothing it receives later can have been sent on yet
+	if (!get_tcp_info(from_fd, from) || !get_tcp_info(to_fd, to))
+		return false;
+	offset = static_cast<long long>(to.tcpi_bytes_sent - to.tcpi_bytes_retrans
+			+ to.tcpi_notsent_bytes - from.tcpi_bytes_received);
+	return true;
+}
+
+bool sockmap::make_key(int fd, key &k) {
+	sockaddr_in local, remote;
+	socklen_t local_len = sizeof(local), remote_len = sizeof(remote);
+	if (::getsockname(fd, reinterpret_cast<sockaddr *>(&local), &local_len) < 0
+			|| ::getpeername(fd, reinterpret_cast<sockaddr *>(&remote), &remote_len) < 0
+			|| local.sin_family != AF_INET || remote.sin_family != AF_INET)
+		return false;
+	// same byte order the verdict program sees in __sk_buff
+	k.local_ip4 = local.sin_addr.s_addr;
+	k.remote_ip4 = remote.sin_addr.s_addr;
+	k.local_port = ntohs(local.sin_port);
+	k.remote_port = remote.sin_port;
+	return true;
+}
+
+bool sockmap::update(int map_fd, const key &k, int fd) {
+	union bpf_attr attr;
+	std::memset(&attr, 0, sizeof(attr));
+	attr.map_fd = static_cast<unsigned int>(map_fd);
+	attr.key = reinterpret_cast<unsigned long>(&k);
+	attr.value = reinterpret_cast<unsigned long>(&fd);
+	attr.flags = BPF_ANY;
+	if (bpf(BPF_MAP_UPDATE_ELEM, attr) < 0) {
+		// a full map would fail every new bridge, so report it once
+		// until an insert works again
+		if (!m_insert_failing) {
+			std::cerr << "sockmap: insert failed: "
+					<< (errno == E2BIG ?
+							"map full, raise sockmap_max_bridges" :
+							std::strerror(errno))
+					<< ", bridges use the normal relay meanwhile" << std::endl;
+			m_insert_failing = true;
+		}
+		return false;
+	}
+	return true;
+}
+
+void sockmap::erase(int map_fd, const key &k) {
+	union bpf_attr attr;
+	std::memset(&attr, 0, sizeof(attr));
+	attr.map_fd = static_cast<unsigned int>(map_fd);
+	attr.key = reinterpret_cast<unsigned long>(&k);
+	bpf(BPF_MAP_DELETE_ELEM, attr);
+}
+
+void sockmap::unload() {
+	if (m_verdict_fd >= 0)
+		::close(m_verdict_fd);
+	if (m_parser_fd >= 0)
+		::close(m_parser_fd);
+	if (m_map_fd >= 0)
+		::close(m_map_fd);
+	if (m_peer_map_fd >= 0)
+		::close(m_peer_map_fd);
+	m_peer_map_fd = m_map_fd = m_parser_fd = m_verdict_fd = -1;
+}
+
+#else
+
+sockmap::sockmap() :
+		m_peer_map_fd(-1), m_map_fd(-1), m_parser_fd(-1), m_verdict_fd(-1), m_insert_failing(
+				false) {
+}
+
+sockmap::~sockmap() {
+}
+
+bool sockmap::load(unsigned int) {
+	std::cerr << "sockmap: not supported on this platform" << std::endl;
+	return false;
+}
+
+bool sockmap::insert(int, int) {
+	return false;
+}
+
+bool sockmap::forward_offset(int, int, long long &) {
+	return false;
+}
+
+#endif
+
+} /* namespace ssh_ssl_proxy */
@@ -0,0 +1,72 @@
+/*
+  sockmap.h
+
+ This file is part of ssh_ssl_proxy.
+
+ ssh_ssl_proxy is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ ssh_ssl_proxy is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with ssh_ssl_proxy.  If not, see <http://www.gnu.org/licenses/>.
+
+ Kernel fast path for established bridges (Linux only).
+ Two BPF sockhashes are used. The peer map stores every socket of a
+ bridge under the address tuple of its peer. The stream verdict program
+ is attached to the second map and looks up the tuple of the socket data
+ arrived on in the peer map, so the payload goes straight to the other
+ end. A socket is put into the second map only after its peer is in the
+ peer map, and nothing is ever taken out before the socket is closed,
+ so redirected data is never dropped or passed back to user space.
+ Only IPv4 tcp bridges are offloaded, local stream upstreams stay on the
+ normal relay.
+ */
+
+#ifndef SOCKMAP_H_
+#define SOCKMAP_H_
+
+#include "ssh_ssl_proxy.h"
+
+namespace ssh_ssl_proxy {
+
+class sockmap {
+public:
+	explicit sockmap();
+	virtual ~sockmap();
+	// loads maps for max_bridges bridges and the programs, returns false if
+	// the kernel or privileges do not allow it
+	bool load(unsigned int max_bridges);
+	bool loaded(){return m_map_fd >= 0;};
+	// inserts both sockets of a bridge, returns false if they can not be offloaded;
+	// the relay has to be idle, the sockets stay in the maps until closed
+	bool insert(int downstream_fd, int upstream_fd);
+	// bytes `to` has taken to send minus bytes `from` has received; it stays
+	// the same while the kernel forwards, so it tells when all data has passed
+	bool forward_offset(int from_fd, int to_fd, long long &offset);
+private:
+	struct key {
+		unsigned int local_ip4;
+		unsigned int remote_ip4;
+		unsigned int local_port;
+		unsigned int remote_port;
+	};
+	bool make_key(int fd, key &k);
+	bool update(int map_fd, const key &k, int fd);
+	void erase(int map_fd, const key &k);
+	void unload();
+	int m_peer_map_fd;
+	int m_map_fd;
+	int m_parser_fd;
+	int m_verdict_fd;
+	bool m_insert_failing;
+};
+
+} /* namespace ssh_ssl_proxy */
+
+#endif /* SOCKMAP_H_ */
@@ -37,6 +37,7 @@
 #include "ssh_ssl_proxy.h"
 #include "configuration.h"
 #include "bridge.h"
+#include "sockmap.h"
 
 int main(int argc, char* argv[]) {
 	try {
@@ -45,9 +46,15 @@ int main(int argc, char* argv[]) {
 
 		boost::asio::io_service ios;
 
+		// kernel fast path, falls back to the normal relay when not available
+		ssh_ssl_proxy::sockmap offload;
+		if (config.sockmap() && !offload.load(config.sockmap_max_bridges())) {
+			std::cerr << "sockmap not available, using normal relay" << std::endl;
+		}
+
 		ssh_ssl_proxy::bridge::acceptor acceptor(ios, config.local_host(),
-				config.local_port(), config.forward_host(),
-				config.forward_port_ssh(), config.forward_port_ssl());
+				config.local_port(), config.forward_ssh(), config.forward_ssl(),
+				offload.loaded() ? &offload : 0);
 		acceptor.accept_connections();
 
 		boost::asio::signal_set signals(ios, SIGINT, SIGTERM);
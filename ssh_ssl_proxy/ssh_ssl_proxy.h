@@ -29,6 +29,7 @@
 #include <iostream>
 #include <string>
 
+#include <boost/array.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/bind.hpp>